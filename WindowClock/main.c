@@ -78,6 +78,22 @@ PC3 … 7seg C3
              Switch In PB1 ━┃ 10       11 ┃━ PB0 IR Sensor In
                             ┗━━━━━━━━━━━━━┛
 
+
+――――――――――――――――――――――――――――――――――――
+□ スタンバイ電流の見積もり
+――――――――――――――――――――――――――――――――――――
+3V 25℃でのデータシート代表値から見積もった概算値 STBY_NA_xxx と変数 standby_na に対応
+
+RTC + XOSC32K … 0.7µA 時計のため動作させたまま
+コア リーク   … 0.1µA
+BOD          … 0 ヒューズ(SLEEP = DIS)でスタンバイ中は無効
+ADC          … 0 RUNSTBYなしなのでスタンバイ中は停止 get_vの後は無効にしている
+TCA0         … 0 tinyAVR 1シリーズのTCAはスタンバイ中に動作しない
+VREF         … 0 VREF_CTRLBで強制有効にしていないのでADCの要求がなければ停止
+入力バッファ  … 0 7セグのピンはseg_all_offで出力Lowに固定、PB2/PB3はXOSC32Kが使用
+               PB0/PB1は起床要因なので有効のまま(PB1のプルアップはスイッチが開いていれば流れない)
+合計         … 約0.8µA
+
 */
 
 //---------------------------------
@@ -102,6 +118,45 @@ PC3 … 7seg C3
 //低電圧リセットをかける電圧
 #define MIN_SUPPLY_V 1.70
 
+//時刻設定時のボタン長押しリピート(ms)
+#define REPEAT_FIRST_MS 400 //押してからリピートが始まるまでの時間
+#define REPEAT_START_MS 200 //リピート開始時の間隔 1回ごとに1/4ずつ短くして加速する
+#define REPEAT_MIN_MS   120 //加速後の最短間隔 指を離すまでの反応時間(200ms程度)で1～2つ行き過ぎる程度に抑える
+#define REPEAT_MIN_STEP 5   //分設定で最短間隔に達した後は5分単位で進める
+#define REPEAT_LIMIT    800 //long_pushがこの値を越えたらリピートをやめ押す前の時刻に戻す(1000でモード切り替え)
+
+//時刻設定モードでボタンを押した時のwakeup値 リピートで設定が数秒で終わるので通常(4000)より短くして起きている時間を減らす
+#define WAKEUP_SET 1600
+
+//スタンバイ電流の見積もり(nA) 内訳と0にしている理由は先頭のコメント「スタンバイ電流の見積もり」を参照
+#define STBY_NA_RTC_XOSC 700 //RTC + XOSC32K
+#define STBY_NA_CORE     100 //コア リーク
+#define STBY_NA_BOD      0   //ヒューズでスタンバイ中は無効
+#define STBY_NA_ADC      0   //RUNSTBYなし
+#define STBY_NA_TCA      0   //スタンバイ中は動作しない
+#define STBY_NA_VREF     0   //強制有効にしていない
+#define STBY_NA_IBUF     0   //出力固定またはXOSC32K/起床要因
+#define STBY_NA_TOTAL    (STBY_NA_RTC_XOSC + STBY_NA_CORE + STBY_NA_BOD + STBY_NA_ADC + STBY_NA_TCA + STBY_NA_VREF + STBY_NA_IBUF)
+
+//割り込みのタイミング調査用トレース 1にするとトレースポイントでSRAMのリングバッファにイベントを記録する
+//記録したバッファはUPDIでSRAMをダンプし tools/trace_decode.py でタイムラインに変換する
+#define TRACE_ENABLE 0
+//TCA割り込み(約1ms毎)もトレースするか。有効にするとバッファがすぐTCAのイベントで埋まるので必要な時だけ1にする
+#define TRACE_TCA    0
+
+//トレースのイベントID tools/trace_decode.py のEVENTSと合わせること 0は未記録
+#define TR_TCA_IN    0x10
+#define TR_TCA_OUT   0x11
+#define TR_LONG_PUSH 0x12 //長押しでモード切り替え
+#define TR_RTC_IN    0x20
+#define TR_RTC_OUT   0x21
+#define TR_PORTB_IN  0x30
+#define TR_PORTB_OUT 0x31
+#define TR_GETV_IN   0x40
+#define TR_GETV_OUT  0x41
+#define TR_SLEEP     0x50
+#define TR_WAKE      0x51
+
 
 //---------------------------------
 // グローバル変数の宣言
@@ -121,14 +176,18 @@ uint8_t hour = 0;
 uint16_t wakeup = 0;
 
 //表示モード
-uint8_t mode = MODE_CLOCK;
+volatile uint8_t mode = MODE_CLOCK;
 
 //ボタン 長押しチェック用変数
 volatile uint16_t long_push = 0;
 
 //長押しでモードを切り替えた後、ボタンを離した時に1回ボタンを入力したことになってしまうのを防ぐため
 //モード切替後最初のボタン入力を1回無効にするフラグ
-uint8_t change_mode_after = 0;
+volatile uint8_t change_mode_after = 0;
+
+//時刻設定モードでボタンを押し続けてリピート中のフラグ。リピート中は設定中の桁を点滅させずに表示し続ける
+//REPEAT_LIMITを越えてモード切り替えの長押しになったら0に戻し、点滅表示に戻す
+volatile uint8_t set_holding = 0;
 
 //現在の電源電圧と太陽電池電圧
 float supply_v = 0.0;
@@ -173,13 +232,60 @@ uint8_t old_dig2 = 0;
 uint8_t old_dig4 = 0;
 uint8_t old_dig5 = 0;
 
+//スタンバイ電流の見積もり(nA) 実行中には計算せず、UPDI経由でデバッガから読み出して確認するための定数
+const uint16_t standby_na __attribute__((used)) = STBY_NA_TOTAL;
+
+#if TRACE_ENABLE
+//トレース用リングバッファ 1イベント4バイト(イベントID, RTC_CNTL, trace_tick下位, trace_tick上位)×64イベント
+//idxは次に書き込むバイト位置。uint8_tなので256で自然に折り返す
+//ダンプの中からバッファを探せるよう先頭にマジック"WCTR"を置く
+struct {
+	uint8_t magic[4];
+	uint8_t idx;
+	uint8_t buf[256];
+} trace = {{'W', 'C', 'T', 'R'}, 0, {0}};
+
+//TCA割り込みごとに1進めるカウンター RTCの0.5秒カウントより細かい時間(約1ms単位)を記録するために使う
+//TCA0_SINGLE_CNTはCMP0 = 1で毎回0に戻すので時間の記録には使えない。16bitにして約65秒まで曖昧さなく経過時間を追えるようにする
+//スタンバイ中はTCAが止まるのでカウントも止まる
+volatile uint16_t trace_tick = 0;
+#endif
+
 //---------------------------------
 // プログラム本文
 //---------------------------------
 
 
+#if TRACE_ENABLE
+//トレースバッファに1イベント記録する関数 割り込み外からも呼ばれるので書き込み中は割り込みを禁止する
+//インライン展開してトレースポイント1つあたり20サイクル程度に抑える
+static inline __attribute__((always_inline)) void trace_put (uint8_t id) {
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t *p = &trace.buf[trace.idx];
+	uint16_t tick = trace_tick;
+	p[0] = id;
+	p[1] = RTC_CNTL;
+	p[2] = tick;
+	p[3] = tick >> 8;
+	trace.idx += 4;
+	SREG = sreg;
+}
+#define TRACE(id) trace_put(id)
+#else
+#define TRACE(id)
+#endif
+
+#if TRACE_ENABLE && TRACE_TCA
+#define TRACE_T(id) trace_put(id)
+#else
+#define TRACE_T(id)
+#endif
+
 //キャパシタに蓄えられた電源電圧と太陽電池の発電電圧を取得する関数
 void get_v (void) {
+
+	TRACE(TR_GETV_IN);
 	
 	uint16_t x = 0;
 	uint16_t y = 0;
@@ -251,6 +357,81 @@ void get_v (void) {
 	v_dig2  = seg[(spv / 10) % 10];
 	v_dig4  = seg[slv % 10];
 	v_dig5  = seg[(slv / 10) % 10];
+
+	TRACE(TR_GETV_OUT);
+}
+
+//時刻設定モードで時または分を1つ進める関数
+void time_step (void) {
+	if(mode == MODE_HOUR_SET) {
+		if(++hour >= 24) hour = 0;
+	}else{
+		if(++min >= 60) min = 0; //リピート中に59を越えても設定済みの時を変えないよう繰り上げない
+	}
+}
+
+//時刻設定モードでボタンが押された時の動作 押した瞬間に1つ進め、押し続けると加速しながらリピートする
+//長押しがREPEAT_LIMITを越えたらリピートを止めて押す前の時刻を点滅表示に戻す。以後はモード切り替えのための長押しとして扱う
+void set_repeat (void) {
+
+	uint8_t start_mode = mode;
+	uint8_t start_hour = hour;
+	uint8_t start_min = min;
+	uint16_t interval = REPEAT_FIRST_MS;
+	uint16_t t = 0;
+	uint16_t push;
+
+	wakeup = WAKEUP_SET;
+	time_step();
+	set_holding = 1;
+
+	while(!(VPORTB_IN & PIN1_bm)) {
+
+		//長押しでモードが切り替わった 通常はREPEAT_LIMITで既に押す前の時刻に戻っている
+		if(mode != start_mode || change_mode_after) {
+			if(set_holding) {
+				hour = start_hour;
+				min = start_min;
+				set_holding = 0;
+			}
+			while(!(VPORTB_IN & PIN1_bm));
+			change_mode_after = 0;
+			return;
+		}
+
+		//long_pushはTCA割り込みで書き換わる16bit変数なので割り込みを止めて読む
+		cli();
+		push = long_push;
+		sei();
+
+		//モード切り替えの長押しになったのでリピートで進めた分を取り消し、点滅表示に戻して切り替わるのを待つ
+		if(set_holding && push > REPEAT_LIMIT) {
+			hour = start_hour;
+			min = start_min;
+			set_holding = 0;
+		}
+
+		_delay_ms(1);
+
+		if(set_holding && ++t >= interval) {
+			t = 0;
+			if(mode == MODE_MIN_SET && interval == REPEAT_MIN_MS) {
+				//次のREPEAT_MIN_STEPの倍数まで進める
+				min = (min / REPEAT_MIN_STEP + 1) * REPEAT_MIN_STEP;
+				if(min >= 60) min = 0;
+			}else{
+				time_step();
+			}
+			wakeup = WAKEUP_SET;
+
+			//次の間隔を決める 1回目のリピート以降は1/4ずつ短くする
+			if(interval == REPEAT_FIRST_MS) interval = REPEAT_START_MS;
+			else interval -= interval / 4;
+			if(interval < REPEAT_MIN_MS) interval = REPEAT_MIN_MS;
+		}
+	}
+
+	set_holding = 0;
 }
 
 //ボタン操作を受け付けながら待機する関数
@@ -277,25 +458,12 @@ void sens_delay_ms (uint16_t num) {
 				break;
 
 				case MODE_HOUR_SET:
-					while(!(VPORTB_IN & PIN1_bm));
-					if(change_mode_after) {
-						change_mode_after = 0;
-					}else{
-						if(++hour >= 24) hour = 0;
-						_delay_ms(100);
-					}
-				break;
-
 				case MODE_MIN_SET:
-					while(!(VPORTB_IN & PIN1_bm));
 					if(change_mode_after) {
+						while(!(VPORTB_IN & PIN1_bm));
 						change_mode_after = 0;
 					}else{
-						if(++min >= 60) {
-							min = 0;
-							if(++hour >= 24) hour = 0;
-						}
-						_delay_ms(100);
+						set_repeat();
 					}
 				break;
 			}
@@ -326,9 +494,27 @@ void change_mode (uint8_t cmode) {
 	}
 }
 
+//スリープ前の準備をする関数 割り込み禁止の状態で呼ぶこと
+//スタンバイ中に動かしたままにするのはRTC/XOSC32KとPB0/PB1の割り込み(起床要因)だけで、それ以外は既に止まっている
+//・TCA0とADCはスタンバイ中に動作しないので停止の書き込みは不要
+//・7セグのピンはseg_all_offで出力Lowに固定されているので入力バッファを切っても電流は変わらない
+//・VREFは強制有効(VREF_CTRLB)にしていないのでADCの要求がなければ止まる
+//・BODはヒューズでスタンバイ中は無効
+//そのため毎分のRTC起床ごとにレジスタを書き換えることはせず、念のためのADC無効化だけ行う
+void sleep_prepare (void) {
+
+	//ADCを無効に(get_vの後は無効になっているはずだが念のため)
+	ADC0_CTRLA = 0b00000000; //ADC Disable
+}
+
 //TCA割り込み
 ISR (TCA0_CMP0_vect) {
 
+#if TRACE_ENABLE
+	trace_tick++;
+#endif
+	TRACE_T(TR_TCA_IN);
+
 	TCA0_SINGLE_CNT = 0;//カウントリセット
 	TCA0_SINGLE_INTFLAGS |= 0b00010000; //割り込み要求フラグを解除
 
@@ -336,6 +522,7 @@ ISR (TCA0_CMP0_vect) {
 	//メインループのseg_all_off関数とsleep_mode関数の間にこの割り込みが入り中途半端に7セグが点灯した状態でスリープするのを防ぐ記述
 	if(!wakeup) {
 		seg_all_off();
+		TRACE_T(TR_TCA_OUT);
 		return;
 	}
 
@@ -404,7 +591,9 @@ ISR (TCA0_CMP0_vect) {
 	//時刻設定時の点滅演出
 	//点滅カウンター
 	static uint16_t wink = 0;
-	if(mode == MODE_HOUR_SET) {
+	if(set_holding) {
+		wink = 512;
+	}else if(mode == MODE_HOUR_SET) {
 		if(++wink < 512) dig4 = dig5 = 0b00000000;
 		else if (wink > 1023) wink = 0;
 	}else if(mode == MODE_MIN_SET) {
@@ -538,6 +727,7 @@ ISR (TCA0_CMP0_vect) {
 			long_push = 0;
 		}else{
 			if(++long_push > 1000) {
+				TRACE(TR_LONG_PUSH);
 				long_push = 0;
 				if(unset) {
 					unset = 0; //時刻未設定フラグを折る
@@ -561,15 +751,19 @@ ISR (TCA0_CMP0_vect) {
 		}
 	}
 
+	TRACE_T(TR_TCA_OUT);
 }
 
 //外部割り込み PB0が変化したら 両方のエッジを検出する(片方エッジにしたいがそうするとなぜかスタンバイから復帰しない)
 ISR(PORTB_PORT_vect) {
+
+	TRACE(TR_PORTB_IN);
 	
 	PORTB_INTFLAGS |= 0b00000010; //割り込み要求フラグ解除
 
 	//赤外線センサー PB0がLowに切り替わったら何もせず返す 両方のエッジを検出するようにしているので立ち下がりエッジ割り込みはここで無効にする
 	if(!(VPORTB_IN & PIN0_bm)) {
+		TRACE(TR_PORTB_OUT);
 		return;
 	}
 
@@ -578,6 +772,7 @@ ISR(PORTB_PORT_vect) {
 
 		//前回寝てから3カウント以内だったら何もせずに再び寝る
 		if(!wakeup && (RTC_CNT - last_rtc_cnt) < 3) {
+			TRACE(TR_PORTB_OUT);
 			return;
 		}
 
@@ -589,14 +784,17 @@ ISR(PORTB_PORT_vect) {
 
 		//一定時間起き上がらせる
 		if(wakeup < 800) wakeup = 800;
+		TRACE(TR_PORTB_OUT);
 		return;
 	}
 
+	TRACE(TR_PORTB_OUT);
 	return;
 }
 
 //リアルタイムクロック 比較一致割り込み
 ISR(RTC_CNT_vect) {
+	TRACE(TR_RTC_IN);
 	RTC_CNT = 0;
 	RTC_INTFLAGS |= 0b00000010;
 
@@ -628,6 +826,7 @@ ISR(RTC_CNT_vect) {
 		}
 	}
 
+	TRACE(TR_RTC_OUT);
 	return;
 }
 
@@ -713,8 +912,21 @@ int main(void) {
 			yet_v = 1;
 			s24count = 0;
 			old_min = old_hour = 255;
-			//寝る
-			sleep_mode();
+			//準備中に赤外線センサーの割り込みでwakeupがセットされても取りこぼさないよう割り込みを禁止して準備する
+			cli();
+			sleep_prepare();
+			if(wakeup) {
+				//準備中に起こされていたら寝ない
+				sei();
+			}else{
+				//寝る sei直後の1命令は割り込みより先に実行されるのでsleep_cpuの前に起床要因を取りこぼさない
+				TRACE(TR_SLEEP);
+				sleep_enable();
+				sei();
+				sleep_cpu();
+				sleep_disable();
+				TRACE(TR_WAKE);
+			}
 		}
 		
 		sens_delay_ms(5);
@@ -0,0 +1,131 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+"""
+WindowClock トレースバッファのデコーダ
+
+main.c の TRACE_ENABLE を 1 にしてビルドしたファームウェアの SRAM を
+UPDI (pymcuprog など) でダンプするか、シミュレータのメモリスナップショットを保存し
+その中からトレースバッファを探してタイムラインとして表示する
+
+  python3 trace_decode.py sram.bin
+  python3 trace_decode.py sram.hex
+
+入力は生バイナリ、または Intel HEX (拡張子 .hex / .ihex)
+バッファはマジック "WCTR" で探すので、ダンプの開始アドレスは問わない
+"""
+
+import argparse
+import struct
+import sys
+
+MAGIC = b"WCTR"
+BUF_LEN = 256
+ENTRY_LEN = 4
+
+# main.c の TR_xxx と合わせること
+EVENTS = {
+    0x10: "TCA_IN",
+    0x11: "TCA_OUT",
+    0x12: "LONG_PUSH",
+    0x20: "RTC_IN",
+    0x21: "RTC_OUT",
+    0x30: "PORTB_IN",
+    0x31: "PORTB_OUT",
+    0x40: "GETV_IN",
+    0x41: "GETV_OUT",
+    0x50: "SLEEP",
+    0x51: "WAKE",
+}
+
+
+def read_ihex(path):
+    # Intel HEX を読み、最小アドレスからの連続したバイト列にする 抜けている所は0で埋める
+    data = {}
+    base = 0
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if not line.startswith(":"):
+                continue
+            raw = bytes.fromhex(line[1:])
+            count, addr, rtype = raw[0], struct.unpack(">H", raw[1:3])[0], raw[3]
+            payload = raw[4:4 + count]
+            if rtype == 0x00:
+                for i, b in enumerate(payload):
+                    data[base + addr + i] = b
+            elif rtype == 0x02:
+                base = struct.unpack(">H", payload)[0] << 4
+            elif rtype == 0x04:
+                base = struct.unpack(">H", payload)[0] << 16
+            elif rtype == 0x01:
+                break
+    if not data:
+        return b""
+    lo, hi = min(data), max(data)
+    return bytes(data.get(a, 0) for a in range(lo, hi + 1))
+
+
+def load(path):
+    if path.lower().endswith((".hex", ".ihex")):
+        return read_ihex(path)
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def decode(dump):
+    pos = dump.find(MAGIC)
+    if pos < 0:
+        raise ValueError("トレースバッファ(マジック WCTR)が見つかりません TRACE_ENABLE=1 でビルドしましたか")
+    head = pos + len(MAGIC)
+    if head + 1 + BUF_LEN > len(dump):
+        raise ValueError("ダンプがトレースバッファの途中で切れています")
+    idx = dump[head]
+    buf = dump[head + 1:head + 1 + BUF_LEN]
+
+    # idx が次に書き込む位置なので、そこから1周分が古い順になる
+    entries = []
+    for n in range(BUF_LEN // ENTRY_LEN):
+        off = (idx + n * ENTRY_LEN) % BUF_LEN
+        ev, rtc, tick_lo, tick_hi = buf[off:off + ENTRY_LEN]
+        if ev == 0:
+            continue  # まだ記録されていない
+        entries.append((ev, rtc, tick_lo | (tick_hi << 8)))
+    return entries
+
+
+def main():
+    ap = argparse.ArgumentParser(description="WindowClock のトレースバッファをタイムラインに変換する")
+    ap.add_argument("dump", help="SRAM ダンプ (生バイナリまたは Intel HEX)")
+    args = ap.parse_args()
+
+    try:
+        entries = decode(load(args.dump))
+    except (OSError, ValueError) as e:
+        print(e, file=sys.stderr)
+        return 1
+
+    # rtc: RTC_CNTL (0.5秒単位 1分で0に戻る)
+    # tick: TCA割り込みの回数 (約1ms単位 65536で折り返す)
+    # dtick: 前のイベントからのtickの差 SLEEPからWAKEまではTCAが止まっていて経過時間を表さないので "-" にする
+    print("  #  event       rtc[s]   tick  dtick")
+    prev_tick = None
+    asleep = False
+    for n, (ev, rtc, tick) in enumerate(entries):
+        name = EVENTS.get(ev, "0x%02X?" % ev)
+        if prev_tick is None:
+            dtick = ""
+        elif asleep:
+            dtick = "-"
+        else:
+            dtick = "%+d" % ((tick - prev_tick) % 65536)
+        print("%3d  %-10s %6.1f  %5d  %5s" % (n, name, rtc / 2.0, tick, dtick))
+        prev_tick = tick
+        if ev == 0x50:
+            asleep = True
+        elif ev == 0x51:
+            asleep = False
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())